@@ -21,21 +21,37 @@
  * with this program. If not, see <https://www.gnu.org/licenses/>.
  */
 
+// Needed for `sched_getcpu`.
+#if !defined(NO_SCHED_GETCPU)
+	#define _GNU_SOURCE
+#endif
+
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <libgen.h>
 #include <limits.h>
 #include <pwd.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef MEMORY_MERGE
+	#include <sys/prctl.h>
+#endif
+
 
 /*
  * CONFIGURATION
@@ -136,6 +152,24 @@
 	#error WWW_USER: not defined.
 #endif
 
+#if !defined(TRACE_SAMPLE_RATE)
+	#define TRACE_SAMPLE_RATE 1
+#endif
+
+#if TRACE_SAMPLE_RATE < 1
+	#error TRACE_SAMPLE_RATE: must be greater than 0.
+#endif
+
+#ifdef MEMORY_MERGE
+	#if !defined(__linux__)
+		#error MEMORY_MERGE: only supported on Linux.
+	#endif
+	// Linux >= 6.4. Older headers do not define it.
+	#if !defined(PR_SET_MEMORY_MERGE)
+		#define PR_SET_MEMORY_MERGE 67
+	#endif
+#endif
+
 
 /*
  * CONSTANTS
@@ -145,6 +179,13 @@
 // Exit statuses conform to the BSD convention.
 // See <https://www.freebsd.org/cgi/man.cgi?query=sysexits>.
 
+/*
+ * Constant: EX_USAGE
+ *
+ * Status to exit with if the programme was called incorrectly.
+ */
+#define EX_USAGE 64
+
 /*
  * Constant: EX_NOINPUT
  *
@@ -249,6 +290,104 @@
  */
 #define CR_TS_MAX 128
 
+/*
+ * Constant: CR_TRACE_MAGIC
+ *
+ * Marks a <TRACE_FILE> as initialised ("cgirunas", little-endian).
+ */
+#define CR_TRACE_MAGIC 0x73616e7572696763
+
+/*
+ * Constant: CR_TRACE_VERSION
+ *
+ * Layout version of <TRACE_FILE>.
+ * Must be incremented whenever <trace_t>, <trace_table_t>,
+ * or <trace_rec_t> change.
+ */
+#define CR_TRACE_VERSION 4
+
+/*
+ * Constant: CR_TRACE_SLOTS
+ *
+ * How many records <TRACE_FILE> holds.
+ */
+#define CR_TRACE_SLOTS 1024
+
+/*
+ * Constant: CR_TRACE_STRIPES
+ *
+ * Across how many cache lines counters are spread.
+ * See <trace_count> for details.
+ */
+#define CR_TRACE_STRIPES 64
+
+/*
+ * Constants: Stages
+ *
+ * Indices into <trace_rec_t.stages>.
+ *
+ *    CR_STAGE_ENV    - The environment has been cleaned up.
+ *    CR_STAGE_CONF   - The configuration has been checked.
+ *    CR_STAGE_SELF   - The self-check has been completed.
+ *    CR_STAGE_SCRIPT - The script's UID and GID have been checked.
+ *    CR_STAGE_DROP   - Privileges have been dropped.
+ *    CR_STAGE_END    - The programme is about to exit or
+ *                      to call the CGI handler.
+ *    CR_STAGES       - The number of stages.
+ */
+#define CR_STAGE_ENV    0
+#define CR_STAGE_CONF   1
+#define CR_STAGE_SELF   2
+#define CR_STAGE_SCRIPT 3
+#define CR_STAGE_DROP   4
+#define CR_STAGE_END    5
+#define CR_STAGES       6
+
+/*
+ * Constants: Calls
+ *
+ * Indices into <trace_rec_t.calls>.
+ *
+ *    CR_CALL_STAT     - Calls to `stat`.
+ *    CR_CALL_PATHCONF - Calls to `pathconf`.
+ *    CR_CALL_REALPATH - Calls to `realpath`.
+ *    CR_CALL_NSS      - User and group lookups.
+ *    CR_CALLS         - The number of calls that are counted.
+ */
+#define CR_CALL_STAT     0
+#define CR_CALL_PATHCONF 1
+#define CR_CALL_REALPATH 2
+#define CR_CALL_NSS      3
+#define CR_CALLS         4
+
+/*
+ * Constants: Counters
+ *
+ * Indices into <trace_stripe_t.counts>.
+ *
+ *    CR_COUNT_REQUESTS - Requests.
+ *    CR_COUNT_ERRORS   - Requests that raised an error.
+ *    CR_COUNT_SAMPLED  - Requests that were recorded in detail.
+ *    CR_COUNTS         - The number of counters.
+ */
+#define CR_COUNT_REQUESTS 0
+#define CR_COUNT_ERRORS   1
+#define CR_COUNT_SAMPLED  2
+#define CR_COUNTS         3
+
+/*
+ * Constants: Tables
+ *
+ * Indices into <trace_t.tables>.
+ *
+ *    CR_TABLE_COUNTS - <trace_t.stripes>.
+ *    CR_TABLE_RING   - <trace_t.head> and <trace_t.recs>.
+ *    CR_TABLES       - The number of tables.
+ */
+#define CR_TABLE_COUNTS 0
+#define CR_TABLE_RING   1
+#define CR_TABLES       2
+
 
 /*
  * MACROS
@@ -285,9 +424,9 @@
  *
  * Arguments:
  *
- *    The same as <panic>, but without the status.
+ *    The same as <panic>, but without the line and the status.
  */
-#define ERR_NOINPUT(...) panic(EX_NOINPUT, __VA_ARGS__)
+#define ERR_NOINPUT(...) panic(__LINE__, EX_NOINPUT, __VA_ARGS__)
 
 /*
  * Macro: ERR_NOUSER
@@ -296,9 +435,9 @@
  *
  * Arguments:
  *
- *    The same as <panic>, but without the status.
+ *    The same as <panic>, but without the line and the status.
  */
-#define ERR_NOUSER(...) panic(EX_NOUSER, __VA_ARGS__)
+#define ERR_NOUSER(...) panic(__LINE__, EX_NOUSER, __VA_ARGS__)
 
 /*
  * Macro: ERR_UNAVAILABLE
@@ -307,9 +446,9 @@
  *
  * Arguments:
  *
- *    The same as <panic>, but without the status.
+ *    The same as <panic>, but without the line and the status.
  */
-#define ERR_UNAVAILABLE(...) panic(EX_UNAVAILABLE, __VA_ARGS__)
+#define ERR_UNAVAILABLE(...) panic(__LINE__, EX_UNAVAILABLE, __VA_ARGS__)
 
 /*
  * Macro: ERR_SOFTWARE
@@ -318,9 +457,9 @@
  *
  * Arguments:
  *
- *    The same as <panic>, but without the status.
+ *    The same as <panic>, but without the line and the status.
  */
-#define ERR_SOFTWARE(...) panic(EX_SOFTWARE, __VA_ARGS__)
+#define ERR_SOFTWARE(...) panic(__LINE__, EX_SOFTWARE, __VA_ARGS__)
 
 /*
  * Macro: ERR_OSERR
@@ -329,9 +468,9 @@
  *
  * Arguments:
  *
- *   The same as <panic>, but without the status.
+ *   The same as <panic>, but without the line and the status.
  */
-#define ERR_OSERR(...) panic(EX_OSERR, __VA_ARGS__)
+#define ERR_OSERR(...) panic(__LINE__, EX_OSERR, __VA_ARGS__)
 
 /*
  * Macro: ERR_NOPERM
@@ -340,9 +479,9 @@
  *
  * Arguments:
  *
- *    The same as <panic>, but without the status.
+ *    The same as <panic>, but without the line and the status.
  */
-#define ERR_NOPERM(...) panic(EX_NOPERM, __VA_ARGS__)
+#define ERR_NOPERM(...) panic(__LINE__, EX_NOPERM, __VA_ARGS__)
 
 /*
  * Macro: ERR_CONFIG
@@ -351,9 +490,20 @@
  *
  * Arguments:
  *
- *    The same as <panic>, but without the status.
+ *    The same as <panic>, but without the line and the status.
+ */
+#define ERR_CONFIG(...) panic(__LINE__, EX_CONFIG, __VA_ARGS__)
+
+/*
+ * Macro: ERR_USAGE
+ *
+ * Raise a usage error.
+ *
+ * Arguments:
+ *
+ *    The same as <panic>, but without the line and the status.
  */
-#define ERR_CONFIG(...) panic(EX_CONFIG, __VA_ARGS__)
+#define ERR_USAGE(...) panic(__LINE__, EX_USAGE, __VA_ARGS__)
 
 /*
  * Macro: ASSERT
@@ -367,6 +517,17 @@
  */
 #define ASSERT(cond, ...) if (!(cond)) ERR_UNAVAILABLE(__VA_ARGS__)
 
+/*
+ * Macro: TRACE_CALL
+ *
+ * Count a call for the record of the current request.
+ *
+ * Arguments:
+ *
+ *    call - A call (see <Calls>).
+ */
+#define TRACE_CALL(call) (trace_rec.calls[call]++)
+
 /*
  * Macro: ASS_CONF_NEMPTY
  *
@@ -393,7 +554,7 @@
  *    `pwd` is overwritten with the user's record.
  */
 #define ASS_USER_EXISTS(pwd, user) \
-	if (!(pwd = getpwnam(user))) \
+	if (TRACE_CALL(CR_CALL_NSS), !(pwd = getpwnam(user))) \
 		ERR_NOUSER("%s: no such user.", user)
 
 /*
@@ -411,7 +572,7 @@
  *    `grp` is overwritten with the group's record.
  */
 #define ASS_GROUP_EXISTS(grp, group) \
-	if (!(grp = getgrnam(group))) \
+	if (TRACE_CALL(CR_CALL_NSS), !(grp = getgrnam(group))) \
 		ERR_NOUSER("%s: no such group.", group)
 
 /*
@@ -429,7 +590,7 @@
  *    `pwd` is overwritten with the user's record.
  */
 #define ASS_UID_EXISTS(pwd, uid) \
-		if (!(pwd = getpwuid(uid))) \
+		if (TRACE_CALL(CR_CALL_NSS), !(pwd = getpwuid(uid))) \
 			ERR_NOUSER("UID %d: no such user.", uid)
 
 /*
@@ -447,7 +608,7 @@
  *    `grp` is overwritten with the group's record.
  */
 #define ASS_GID_EXISTS(grp, gid) \
-		if (!(grp = getgrgid(gid))) \
+		if (TRACE_CALL(CR_CALL_NSS), !(grp = getgrgid(gid))) \
 			ERR_NOUSER("GID %d: no such group.", gid)
 
 /*
@@ -465,7 +626,7 @@
  *    `fs` is overwritten with the file's metadata record.
  */
 #define ASS_STAT(fname, fs) \
-	if (stat(fname, fs) != 0) \
+	if (TRACE_CALL(CR_CALL_STAT), stat(fname, fs) != 0) \
 		ERR_NOINPUT("stat %s: %s", fname, strerror(errno))
 
 /*
@@ -609,7 +770,9 @@ if (fs.st_mode & S_ISGID) \
  *    `canon` is overwritten with path's canonical path.
  */
 #define ASS_CANON(canon, path) \
+	caller_line = __LINE__; \
 	canon = realpath_f(path); \
+	caller_line = 0; \
 	ASSERT(STREQ(path, canon), "%s: not canonical.", path)
 
 /*
@@ -628,6 +791,36 @@ if (fs.st_mode & S_ISGID) \
 #define ASS_SAFE_NAME(name) \
 	ASSERT(is_safe_name(name) == 0, "%s: invalid name.", name)
 
+/*
+ * Macro: ASS_EXCL_OWNER
+ *
+ * Call <is_excl_owner_f>, so that errors are
+ * attributed to the line that uses this macro.
+ *
+ * Arguments:
+ *
+ *    See <is_excl_owner_f>.
+ */
+#define ASS_EXCL_OWNER(uid, gid, start, stop) \
+	caller_line = __LINE__; \
+	is_excl_owner_f(uid, gid, start, stop); \
+	caller_line = 0
+
+/*
+ * Macro: ASS_SUBDIR
+ *
+ * Call <is_subdir_f>, so that errors are
+ * attributed to the line that uses this macro.
+ *
+ * Arguments:
+ *
+ *    See <is_subdir_f>.
+ */
+#define ASS_SUBDIR(sub, super) \
+	caller_line = __LINE__; \
+	is_subdir_f(sub, super); \
+	caller_line = 0
+
 /*
  * Macro: STREQ
  *
@@ -699,6 +892,155 @@ if (fs.st_mode & S_ISGID) \
 #define STRNOSTARTW(a, b) (strncmp(a, b, strlen(b)) != 0)
 
 
+/*
+ * DATA TYPES
+ * ==========
+ */
+
+/* 
+ * Type: list_t
+ *
+ * An item in a linked list.
+ *
+ * See also:
+ *
+ *    - <push>.
+ */
+typedef struct list_s {
+	void          *data;
+	struct list_s *prev;
+} list_t;
+
+/*
+ * Type: prio_class_t
+ *
+ * A pattern that assigns a priority to requests.
+ *
+ * Fields:
+ *
+ *    var     - The name of an environment variable.
+ *    pattern - A string. Matches if the value of `var` contains it,
+ *              ignoring case (see <match_ci> for anchors).
+ *    nice    - The nice value to call the CGI handler with.
+ *
+ * See also:
+ *
+ *    - <prio_classes>
+ */
+typedef struct prio_class_s {
+	const char *var;
+	const char *pattern;
+	int         nice;
+} prio_class_t;
+
+/*
+ * Type: trace_rec_t
+ *
+ * A record of a request in <TRACE_FILE>.
+ *
+ * Records are written by <trace_commit> and read by <trace_dump>.
+ * Only requests chosen by <trace_sample> are recorded.
+ * `seq` is 0 while a record is being written and the number of the
+ * request plus 1 afterwards; a record is only valid if `seq` is the
+ * same before and after reading it.
+ *
+ * Fields:
+ *
+ *    seq    - Sequence number (see above).
+ *    start  - When the request started, in seconds since the epoch.
+ *    stages - When each stage was completed, in microseconds
+ *             since the start of the request; 0 if it wasn't.
+ *             Indexed by <Stages>.
+ *    calls  - How often functions that may be slow were called.
+ *             Indexed by <Calls>.
+ *    uid    - The UID of the script's owner; 0 if not known yet.
+ *    ino    - The inode number of the script; 0 if not known yet.
+ *    status - The status the programme exited with;
+ *             0 if the CGI handler was called.
+ *    line   - The line of the source code that raised the error;
+ *             0 if the CGI handler was called.
+ */
+typedef struct trace_rec_s {
+	_Atomic uint64_t seq;
+	int64_t          start;
+	uint32_t         stages[CR_STAGES];
+	uint32_t         calls[CR_CALLS];
+	uint32_t         uid;
+	uint64_t         ino;
+	int32_t          status;
+	int32_t          line;
+} trace_rec_t;
+
+/*
+ * Type: trace_stripe_t
+ *
+ * A set of counters in <TRACE_FILE>.
+ *
+ * Each stripe fills a cache line of its own.
+ *
+ * Fields:
+ *
+ *    counts - Counters, indexed by <Counters>.
+ */
+typedef struct trace_stripe_s {
+	_Alignas(64) _Atomic uint64_t counts[CR_COUNTS];
+} trace_stripe_t;
+
+/*
+ * Type: trace_table_t
+ *
+ * An entry in the directory of tables in <TRACE_FILE>.
+ *
+ * Fields:
+ *
+ *    id     - Which table this is (see <Tables>).
+ *    size   - The size of the table in bytes.
+ *    offset - Where the table starts, in bytes from
+ *             the beginning of the file.
+ */
+typedef struct trace_table_s {
+	uint32_t id;
+	uint32_t size;
+	uint64_t offset;
+} trace_table_t;
+
+/*
+ * Type: trace_t
+ *
+ * The layout of <TRACE_FILE>.
+ *
+ * The file starts with a header that lists the tables it contains,
+ * so that other programmes can find them without knowing this layout.
+ * Each table starts on a cache line of its own. A file whose header
+ * does not match <trace_tables> is rebuilt by <trace_open_f>.
+ *
+ * `magic` is set last when the file is built, so a file
+ * that has not been built completely counts as invalid.
+ *
+ * Fields:
+ *
+ *    magic   - <CR_TRACE_MAGIC>.
+ *    version - <CR_TRACE_VERSION>.
+ *    ntables - <CR_TABLES>.
+ *    size    - The size of the file in bytes.
+ *    tables  - A directory of tables, indexed by <Tables>.
+ *    stripes - Counters, spread across CPUs (see <trace_count>).
+ *              Updated for every request, sampled or not.
+ *    head    - How many requests have been recorded so far.
+ *    recs    - A ring buffer of records.
+ */
+typedef struct trace_s {
+	_Atomic uint64_t magic;
+	uint32_t         version;
+	uint32_t         ntables;
+	uint64_t         size;
+	trace_table_t    tables[CR_TABLES];
+	trace_stripe_t   stripes[CR_TRACE_STRIPES];
+	_Alignas(64) _Atomic uint64_t head;
+	_Alignas(64) trace_rec_t recs[CR_TRACE_SLOTS];
+} trace_t;
+
+
 /*
  * GLOBALS
  * =======
@@ -806,6 +1148,45 @@ const char *const unsafe_env_vars[] =
 	NULL
 };
 
+/*
+ * Global: prio_classes
+ *
+ * A list of patterns that assign a priority to requests.
+ * The first pattern that matches is used; if none matches,
+ * the priority is left as it is.
+ *
+ * Priorities are only ever lowered, that is, nice values
+ * smaller than the current one are ignored. Variables are
+ * looked up in the cleaned up environment (see <safe_env_vars>).
+ *
+ * Patterns match anywhere in a value, regardless of case.
+ * Patterns that start with a '^' only match the beginning of
+ * a value, patterns that end with a '$' only match its end
+ * (e.g., {"REMOTE_ADDR", "^10.1.", 5}). The crawler patterns below include the "/" that separates
+ * a product name from its version (e.g., "Googlebot/2.1"),
+ * so that device names like "Cubot" do not match. Crawlers
+ * that name themselves differently (e.g., "DuckDuckBot-Https/1.1")
+ * are not matched, and a browser whose user agent contains a
+ * product whose name ends with "bot" or "spider" would be.
+ *
+ * The list must be terminated with an entry whose `var` is `NULL`.
+ *
+ * See also:
+ *
+ *    - <prio_class_t>
+ *    - <prio_class>
+ */
+const prio_class_t prio_classes[] =
+{
+	// Crawlers.
+	{"HTTP_USER_AGENT", "bot/",    10},
+	{"HTTP_USER_AGENT", "spider/", 10},
+	{"HTTP_USER_AGENT", "crawler", 10},
+
+	// Terminator. DO *NOT* REMOVE!
+	{NULL, NULL, 0}
+};
+
 /* 
  * Global: prog_path
  *
@@ -823,25 +1204,80 @@ char *prog_path = NULL;
  */ 
 char *prog_name = NULL;
 
+/*
+ * Global: trace_tables
+ *
+ * The directory of tables in <TRACE_FILE>.
+ *
+ * See also:
+ *
+ *    - <trace_t>
+ */
+const trace_table_t trace_tables[CR_TABLES] =
+{
+	{
+		CR_TABLE_COUNTS,
+		sizeof(((trace_t *) NULL)->stripes),
+		offsetof(trace_t, stripes)
+	},
+	{
+		CR_TABLE_RING,
+		sizeof(trace_t) - offsetof(trace_t, head),
+		offsetof(trace_t, head)
+	}
+};
+
+/*
+ * Global: trace
+ *
+ * The mapping of <TRACE_FILE>.
+ * Set by <main>, `NULL` if tracing is disabled.
+ */
+trace_t *trace = NULL;
 
 /*
- * DATA TYPES
- * ==========
+ * Global: trace_rec
+ *
+ * The record of the current request.
+ * Filled in by <main>, written to <trace> by <trace_commit>.
  */
+trace_rec_t trace_rec = {};
 
-/* 
- * Type: list_t
+/*
+ * Global: trace_t0
  *
- * An item in a linked list.
+ * When the current request started. Set by <main>.
+ */
+struct timespec trace_t0 = {};
+
+/*
+ * Global: trace_sampled
  *
- * See also:
+ * Whether the current request is recorded in detail.
+ * Set by <trace_sample>; always 0 if tracing is disabled.
+ */
+#ifdef TRACE_FILE
+	int trace_sampled = 1;
+#else
+	int trace_sampled = 0;
+#endif
+
+/*
+ * Global: trace_ticket
  *
- *    - <push>.
+ * The number of the slot claimed for the current request plus 1;
+ * 0 if no slot has been claimed yet. Set by <trace_commit>.
  */
-typedef struct list_s {
-	void          *data;
-	struct list_s *prev;
-} list_t;
+uint64_t trace_ticket = 0;
+
+/*
+ * Global: caller_line
+ *
+ * The line of the source code that called the current `_f` function;
+ * 0 if none is running. Set by <ASS_CANON>, <ASS_EXCL_OWNER>, and
+ * <ASS_SUBDIR>, so that <panic> can record where a request was refused.
+ */
+int caller_line = 0;
 
 
 /*
@@ -849,14 +1285,19 @@ typedef struct list_s {
  * =========
  */
 
+// Used by <panic>.
+void trace_commit (const int status, const int line);
+
 /* Function: panic
  *
- * Print an error message to STDERR and exit the programme.
+ * Print an error message to STDERR, record the request
+ * with <trace_commit>, and exit the programme.
  *
  * The message is prefixed with a timestamp if STDERR is not a TTY.
  *
  * Arguments:
  * 
+ *    line    - Line of the source code that raised the error.
  *    status  - Status to exit with.
  *    message - Message to print.
  *    ...     - Arguments for the message (think `printf`).
@@ -867,11 +1308,12 @@ typedef struct list_s {
  *
  * Globals:
  *
- *    <prog_name> - The filename of the executable.
- *                  If not `NULL`, `prog_name`, a colon, and a space
- *                  are printed before the message.
+ *    <prog_name>   - The filename of the executable.
+ *                    If not `NULL`, `prog_name`, a colon, and a space
+ *                    are printed before the message.
+ *    <caller_line> - If not 0, recorded instead of `line`.
  */
-void panic (const int status, const char *message, ...) {
+void panic (const int line, const int status, const char *message, ...) {
 	if (!isatty(fileno(stderr))) {
 		time_t now_sec = time(NULL);
 		if (now_sec == -1) {
@@ -903,6 +1345,7 @@ void panic (const int status, const char *message, ...) {
 	vfprintf(stderr, message, argp);
 	va_end(argp);
 	EPRINTF("\n");
+	trace_commit(status, caller_line ? caller_line : line);
 	exit(status);
 }
 
@@ -1041,10 +1484,10 @@ char *getenv_f (char *var) {
 	// but I have to read the environment.
 	// flawfinder: ignore
 	char *value = getenv(var);
-	ASSERT(value, "%s: not set.", *var);
-	ASSERT(STRNE(value, ""), "%s: is empty.", *var);
+	ASSERT(value, "%s: not set.", var);
+	ASSERT(STRNE(value, ""), "%s: is empty.", var);
 	ASSERT(strnlen(value, CR_ENVVAR_VALUE_MAX) < CR_ENVVAR_VALUE_MAX,
-	       "%s: value too long.", *var);
+	       "%s: value too long.", var);
 	return value;
 }
 
@@ -1124,6 +1567,7 @@ int path_max (char *path) {
 	int path_max = CR_PATH_MAX;
 
 	struct stat fs;
+	TRACE_CALL(CR_CALL_STAT);
 	if (stat(path, &fs) != 0)
 		return -1;
 	
@@ -1133,6 +1577,7 @@ int path_max (char *path) {
 	else
 		dir = dirname(path);
 	
+	TRACE_CALL(CR_CALL_PATHCONF);
 	int pc_path_max = pathconf(dir, _PC_PATH_MAX);
 	if (-1 < pc_path_max && pc_path_max < path_max)
 		path_max = pc_path_max;
@@ -1178,6 +1623,7 @@ char *realpath_f (char *path) {
 	char buf[bufsize];
 
 	// Safeguards against bad realpath implementations are in place.
+	TRACE_CALL(CR_CALL_REALPATH);
 	// flawfinder: ignore
 	char *restrict real = realpath(path, buf);
 	ASSERT(real, "realpath %s: %s.", path, strerror(errno));
@@ -1255,9 +1701,12 @@ void is_subdir_f (char *sub, char *super) {
 	ASSERT(max != -1, "stat %s: %s.", super, strerror(errno));
 	int len = strnlen(super, max);
 	ASSERT(len < max, "%s: path too long.", super);
-	char sep = sub[len];
-	ASSERT(STRSTARTW(sub, super) || sep == '/' || sep == '\0',
-	                "%s: not in %s.", sub, super);
+	ASSERT(len > 0, "got empty string as path.");
+	// sub[len] is only read if sub is at least as long as super.
+	// A canonical path only ends with a '/' if it is "/".
+	ASSERT(STRSTARTW(sub, super) &&
+	       (super[len - 1] == '/' || sub[len] == '/' || sub[len] == '\0'),
+	       "%s: not in %s.", sub, super);
 }
 
 /*
@@ -1320,6 +1769,529 @@ int is_safe_name (char *str) {
 	return 0;
 }
 
+/*
+ * Function: match_ci
+ *
+ * Check whether a string contains a pattern, ignoring case.
+ *
+ * If the pattern starts with a '^', it only matches the beginning
+ * of the string; if it ends with a '$', it only matches the end.
+ * There are no other special characters.
+ *
+ * Arguments:
+ *
+ *    str - A string.
+ *    pat - A pattern.
+ *
+ * Returns:
+ *
+ *    Non-zero - `str` matches `pat`.
+ *    0 - `str` does *not* match `pat`.
+ */
+int match_ci (const char *str, const char *pat) {
+	int head = (*pat == '^');
+	if (head) pat++;
+	size_t len = strlen(pat);
+	int tail = (len > 0 && pat[len - 1] == '$');
+	if (tail) len--;
+
+	for (; *str; str++) {
+		size_t i = 0;
+		while (i < len && tolower((unsigned char) str[i]) ==
+		                  tolower((unsigned char) pat[i]))
+			i++;
+		if (i == len && (!tail || !str[i])) return 1;
+		if (head) return 0;
+	}
+	return len == 0;
+}
+
+/*
+ * Function: prio_class
+ *
+ * Find the priority class of the current request.
+ *
+ * Returns:
+ *
+ *    A pointer to the first entry in <prio_classes> that matches
+ *    or `NULL` if none does.
+ */
+const prio_class_t *prio_class (void) {
+	const prio_class_t *class = prio_classes;
+	while (class->var) {
+		// The environment has been cleaned up by now.
+		// flawfinder: ignore
+		const char *value = getenv(class->var);
+		if (value && match_ci(value, class->pattern))
+			return class;
+		class++;
+	}
+	return NULL;
+}
+
+/*
+ * Function: trace_stage
+ *
+ * Record that a stage of the current request has been completed.
+ *
+ * Arguments:
+ *
+ *    stage - A stage (see <Stages>).
+ *
+ * Globals:
+ *
+ *    <trace_rec>     - Updated.
+ *    <trace_t0>      - When the request started.
+ *    <trace_sampled> - Nothing is recorded unless this is non-zero.
+ */
+void trace_stage (const int stage) {
+	if (!trace_sampled) return;
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+		return;
+	int64_t usec = (now.tv_sec - trace_t0.tv_sec) * 1000000 +
+	               (now.tv_nsec - trace_t0.tv_nsec) / 1000;
+	// A stage that took less than 1 µs should not look skipped.
+	trace_rec.stages[stage] = usec > 0 ? (uint32_t) usec : 1;
+}
+
+/*
+ * Function: trace_count
+ *
+ * Increment a counter in a trace file.
+ *
+ * Counters are kept once per CPU, modulo <CR_TRACE_STRIPES>, so that
+ * processes on different CPUs do not contend for the same cache line.
+ * Readers must add up the stripes (see <trace_sum>).
+ *
+ * Arguments:
+ *
+ *    tr      - A mapping of <TRACE_FILE>.
+ *    counter - A counter (see <Counters>).
+ *
+ * Returns:
+ *
+ *    The value of the counter in the chosen stripe
+ *    before it was incremented.
+ *
+ * Caveats:
+ *
+ *    If `sched_getcpu` is unavailable or fails,
+ *    the stripe is chosen by process ID instead.
+ */
+uint64_t trace_count (trace_t *tr, const int counter) {
+	int cpu = -1;
+	#if !defined(NO_SCHED_GETCPU)
+		cpu = sched_getcpu();
+	#endif
+	if (cpu < 0) cpu = getpid();
+
+	trace_stripe_t *stripe = &tr->stripes[cpu % CR_TRACE_STRIPES];
+	return atomic_fetch_add_explicit(&stripe->counts[counter], 1,
+	                                 memory_order_relaxed);
+}
+
+/*
+ * Function: trace_sum
+ *
+ * Add up a counter across all stripes of a trace file.
+ *
+ * Arguments:
+ *
+ *    tr      - A mapping of <TRACE_FILE>.
+ *    counter - A counter (see <Counters>).
+ *
+ * Returns:
+ *
+ *    The value of the counter.
+ */
+uint64_t trace_sum (const trace_t *tr, const int counter) {
+	uint64_t sum = 0;
+	int i;
+	for (i = 0; i < CR_TRACE_STRIPES; i++)
+		sum += atomic_load_explicit(&tr->stripes[i].counts[counter],
+		                            memory_order_relaxed);
+	return sum;
+}
+
+/*
+ * Function: trace_sample
+ *
+ * Count the current request and decide whether to record it in detail.
+ *
+ * If `UNIQUE_ID` is set, the request is sampled if the 64-bit FNV-1a
+ * hash of its value modulo `TRACE_SAMPLE_RATE` is 0, so the webserver
+ * can make the same decision. Otherwise, every `TRACE_SAMPLE_RATE`-th
+ * request that is counted in the same stripe is sampled.
+ *
+ * Arguments:
+ *
+ *    tr - A mapping of <TRACE_FILE>.
+ *
+ * Returns:
+ *
+ *    1 - The request should be recorded in detail.
+ *    0 - Otherwise.
+ */
+int trace_sample (trace_t *tr) {
+	uint64_t n = trace_count(tr, CR_COUNT_REQUESTS);
+
+	// The environment has been cleaned up by now.
+	// flawfinder: ignore
+	const char *id = getenv("UNIQUE_ID");
+	if (id && *id) {
+		n = 0xcbf29ce484222325;
+		for (; *id; id++) {
+			n ^= (unsigned char) *id;
+			n *= 0x100000001b3;
+		}
+	}
+
+	if (n % TRACE_SAMPLE_RATE != 0) return 0;
+	trace_count(tr, CR_COUNT_SAMPLED);
+	return 1;
+}
+
+/*
+ * Function: trace_commit
+ *
+ * Count errors and write the record of the current request
+ * to <TRACE_FILE> if it has been sampled.
+ *
+ * Slots are claimed by incrementing <trace_t.head>, so writers never
+ * wait for each other. If it is called again, e.g., because `execve`
+ * failed, the record is overwritten in the same slot. Does nothing if
+ * tracing is disabled.
+ *
+ * Arguments:
+ *
+ *    status - The status the programme is about to exit with;
+ *             0 if it is about to call the CGI handler.
+ *    line   - The line of the source code that raised the error;
+ *             0 if it is about to call the CGI handler.
+ *
+ * Globals:
+ *
+ *    <trace>         - The mapping of <TRACE_FILE>.
+ *    <trace_ticket>  - The slot to write to, if claimed already.
+ *    <trace_rec>     - The record to write.
+ *    <trace_sampled> - Whether to write the record.
+ */
+void trace_commit (const int status, const int line) {
+	trace_t *tr = trace;
+	if (!tr) return;
+
+	if (status != 0)
+		trace_count(tr, CR_COUNT_ERRORS);
+	if (!trace_sampled) return;
+
+	trace_stage(CR_STAGE_END);
+	if (!trace_ticket)
+		trace_ticket = atomic_fetch_add(&tr->head, 1) + 1;
+	uint64_t ticket = trace_ticket - 1;
+	trace_rec_t *rec = &tr->recs[ticket % CR_TRACE_SLOTS];
+
+	atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	rec->start = trace_rec.start;
+	memcpy(rec->stages, trace_rec.stages, sizeof(rec->stages));
+	memcpy(rec->calls, trace_rec.calls, sizeof(rec->calls));
+	rec->uid = trace_rec.uid;
+	rec->ino = trace_rec.ino;
+	rec->status = status;
+	rec->line = line;
+	atomic_store_explicit(&rec->seq, ticket + 1, memory_order_release);
+}
+
+/*
+ * Function: trace_valid
+ *
+ * Check whether a mapping of a trace file has been initialised
+ * and matches the layout of this version of the programme.
+ *
+ * Argument:
+ *
+ *    tr - A mapping of <TRACE_FILE>.
+ *
+ * Returns:
+ *
+ *    Non-zero - The mapping is valid.
+ *    0 - The mapping is invalid, outdated, or corrupt.
+ */
+int trace_valid (const trace_t *tr) {
+	return atomic_load(&tr->magic) == CR_TRACE_MAGIC &&
+	       tr->version == CR_TRACE_VERSION &&
+	       tr->ntables == CR_TABLES &&
+	       tr->size == sizeof(trace_t) &&
+	       memcmp(tr->tables, trace_tables, sizeof(trace_tables)) == 0;
+}
+
+/*
+ * Function: trace_open_f
+ *
+ * Map a trace file into memory, but abort the programme if an error
+ * occurs or if the file is insecure. The file is created if it does
+ * not exist and rebuilt if it is invalid, outdated, or corrupt
+ * (see <trace_valid>).
+ *
+ * Argument:
+ *
+ *    fname - A filename.
+ *
+ * Returns:
+ *
+ *    A pointer to the mapping.
+ *
+ * Caveats:
+ *
+ *    The file is never changed in place. A new one is built under
+ *    a temporary name and then renamed, so that processes which
+ *    still have the old file mapped can keep writing to it.
+ *    If several processes rebuild the file at the same time,
+ *    the last one wins; the records of the others are lost.
+ */
+trace_t *trace_open_f (const char *fname) {
+	trace_t *tr;
+	struct stat fs;
+
+	int fd = open(fname, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1 && errno != ENOENT)
+		ERR_OSERR("open %s: %s.", fname, strerror(errno));
+
+	if (fd != -1) {
+		if (fstat(fd, &fs) != 0)
+			ERR_OSERR("stat %s: %s.", fname, strerror(errno));
+		ASS_ISREG(fname, fs);
+		ASS_UID(fname, fs, 0);
+		ASS_GID(fname, fs, 0);
+		ASS_NWOTH(fname, fs);
+
+		if (fs.st_size == sizeof(trace_t)) {
+			tr = mmap(NULL, sizeof(trace_t),
+			          PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (tr == MAP_FAILED)
+				ERR_OSERR("mmap %s: %s.",
+				          fname, strerror(errno));
+			if (trace_valid(tr)) {
+				close(fd);
+				return tr;
+			}
+			munmap(tr, sizeof(trace_t));
+		}
+		close(fd);
+	}
+
+	// No other process uses this name, so a file
+	// with this name is left over from a crash.
+	size_t len = strlen(fname) + 32;
+	// flawfinder: ignore
+	char tmp[len];
+	// flawfinder: ignore
+	snprintf(tmp, len, "%s.%ld", fname, (long) getpid());
+	if (unlink(tmp) != 0 && errno != ENOENT)
+		ERR_OSERR("unlink %s: %s.", tmp, strerror(errno));
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	          S_IRUSR | S_IWUSR);
+	if (fd == -1) ERR_OSERR("open %s: %s.", tmp, strerror(errno));
+
+	// cgi-runas is not set-GID, so new files
+	// are owned by the webserver's group.
+	if (fchown(fd, 0, 0) != 0) {
+		unlink(tmp);
+		ERR_OSERR("chown %s: %s.", tmp, strerror(errno));
+	}
+	if (ftruncate(fd, sizeof(trace_t)) != 0) {
+		unlink(tmp);
+		ERR_OSERR("ftruncate %s: %s.", tmp, strerror(errno));
+	}
+
+	tr = mmap(NULL, sizeof(trace_t), PROT_READ | PROT_WRITE,
+	          MAP_SHARED, fd, 0);
+	close(fd);
+	if (tr == MAP_FAILED) {
+		unlink(tmp);
+		ERR_OSERR("mmap %s: %s.", tmp, strerror(errno));
+	}
+
+	// ftruncate has zeroed the file.
+	tr->version = CR_TRACE_VERSION;
+	tr->ntables = CR_TABLES;
+	tr->size = sizeof(trace_t);
+	memcpy(tr->tables, trace_tables, sizeof(trace_tables));
+	atomic_store(&tr->magic, CR_TRACE_MAGIC);
+
+	if (rename(tmp, fname) != 0) {
+		unlink(tmp);
+		ERR_OSERR("rename %s: %s.", tmp, strerror(errno));
+	}
+
+	return tr;
+}
+
+/*
+ * Function: trace_map
+ *
+ * Map a trace file into memory for reading.
+ *
+ * Argument:
+ *
+ *    fname - A filename.
+ *
+ * Returns:
+ *
+ *    A pointer to the mapping or `NULL` on failure.
+ *    `errno` is set accordingly; it is set to `EINVAL`
+ *    if the file is invalid or outdated.
+ */
+const trace_t *trace_map (const char *fname) {
+	int fd = open(fname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) return NULL;
+
+	struct stat fs;
+	if (fstat(fd, &fs) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if (fs.st_size != sizeof(trace_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	trace_t *tr = mmap(NULL, sizeof(trace_t), PROT_READ,
+	                   MAP_SHARED, fd, 0);
+	close(fd);
+	if (tr == MAP_FAILED) return NULL;
+
+	if (!trace_valid(tr)) {
+		munmap(tr, sizeof(trace_t));
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return tr;
+}
+
+/*
+ * Function: trace_stats
+ *
+ * Print the counters of a trace file to STDOUT.
+ *
+ * Argument:
+ *
+ *    fname - A filename.
+ *
+ * Returns:
+ *
+ *    0 on success or -1 on failure.
+ *    `errno` is set accordingly.
+ */
+int trace_stats (const char *fname) {
+	const trace_t *tr = trace_map(fname);
+	if (!tr) return -1;
+
+	printf("requests=%llu errors=%llu sampled=%llu\n",
+	       (unsigned long long) trace_sum(tr, CR_COUNT_REQUESTS),
+	       (unsigned long long) trace_sum(tr, CR_COUNT_ERRORS),
+	       (unsigned long long) trace_sum(tr, CR_COUNT_SAMPLED));
+
+	munmap((void *) tr, sizeof(trace_t));
+	return 0;
+}
+
+/*
+ * Function: trace_dump
+ *
+ * Print the most recent records in a trace file to STDOUT,
+ * oldest first, one per line.
+ *
+ * Arguments:
+ *
+ *    fname - A filename.
+ *    count - How many records to print at most.
+ *    min   - Only print records of requests that took at least
+ *            that many microseconds.
+ *
+ * Returns:
+ *
+ *    The number of records printed or -1 on failure.
+ *    `errno` is set accordingly.
+ */
+int trace_dump (const char *fname, const size_t count, const uint64_t min) {
+	const trace_t *tr = trace_map(fname);
+	if (!tr) return -1;
+
+	trace_rec_t *recs = calloc(CR_TRACE_SLOTS, sizeof(trace_rec_t));
+	if (!recs) {
+		munmap((void *) tr, sizeof(trace_t));
+		return -1;
+	}
+
+	// Walk backwards from the most recent record.
+	size_t n = 0;
+	uint64_t head = atomic_load(&tr->head);
+	uint64_t i = head;
+	while (i > 0 && head - i < CR_TRACE_SLOTS && n < count) {
+		i--;
+		const trace_rec_t *rec = &tr->recs[i % CR_TRACE_SLOTS];
+		trace_rec_t *cpy = &recs[n];
+
+		uint64_t seq = atomic_load_explicit(&rec->seq,
+		                                    memory_order_acquire);
+		if (seq != i + 1) continue;
+		cpy->start = rec->start;
+		memcpy(cpy->stages, rec->stages, sizeof(cpy->stages));
+		memcpy(cpy->calls, rec->calls, sizeof(cpy->calls));
+		cpy->uid = rec->uid;
+		cpy->ino = rec->ino;
+		cpy->status = rec->status;
+		cpy->line = rec->line;
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&rec->seq,
+		                         memory_order_relaxed) != seq)
+			continue;
+
+		if (cpy->stages[CR_STAGE_END] < min) continue;
+		n++;
+	}
+	munmap((void *) tr, sizeof(trace_t));
+
+	const char *const stages[CR_STAGES] =
+		{"env", "conf", "self", "script", "drop", "end"};
+	const char *const calls[CR_CALLS] =
+		{"stat", "pathconf", "realpath", "nss"};
+	size_t j = n;
+	while (j > 0) {
+		trace_rec_t *rec = &recs[--j];
+
+		// flawfinder: ignore
+		char ts[CR_TS_MAX] = {};
+		time_t start = (time_t) rec->start;
+		struct tm *start_rec = localtime(&start);
+		if (!start_rec ||
+		    strftime(ts, CR_TS_MAX, DATE_FORMAT, start_rec) == 0)
+			// flawfinder: ignore
+			snprintf(ts, CR_TS_MAX, "%lld", (long long) start);
+
+		printf("%s: uid=%lu ino=%llu status=%d line=%d",
+		       ts, (unsigned long) rec->uid,
+		       (unsigned long long) rec->ino,
+		       rec->status, rec->line);
+		int k;
+		for (k = 0; k < CR_STAGES; k++)
+			printf(" %s=%lu", stages[k],
+			       (unsigned long) rec->stages[k]);
+		for (k = 0; k < CR_CALLS; k++)
+			printf(" %s=%lu", calls[k],
+			       (unsigned long) rec->calls[k]);
+		printf("\n");
+	}
+
+	free(recs);
+	return n;
+}
+
 
 /*
  * MAIN
@@ -1343,6 +2315,10 @@ int main (int argc, const char *argv[]) {
 	// The environment.
 	extern char **environ;
 	
+	// When the request started.
+	trace_rec.start = time(NULL);
+	clock_gettime(CLOCK_MONOTONIC, &trace_t0);
+
 	// Make sure that errno is 0.
 	errno = 0;
 
@@ -1390,7 +2366,8 @@ int main (int argc, const char *argv[]) {
 				// Safeguards against bad realpath
 				// implementations are in place.
 				// flawfinder: ignore
-				real = realpath(*path, buf);
+				real = (TRACE_CALL(CR_CALL_REALPATH),
+				        realpath(*path, buf));
 			if (real)
 				break;
 			path++;
@@ -1412,6 +2389,50 @@ int main (int argc, const char *argv[]) {
 		prog_name = basename(prog_path);
 
 
+	/*
+	 * Read trace
+	 * ----------
+	 */
+
+	// Only the superuser may do this. The webserver may pass
+	// arguments taken from the query string (see RFC 3875, 4.4),
+	// so they are ignored if anyone else calls cgi-runas.
+
+	#ifdef TRACE_FILE
+		if (argc > 1 && getuid() == 0) {
+			if (!(STREQ(argv[1], "--stats") && argc == 2) &&
+			    !(STREQ(argv[1], "--dump-recent") && argc <= 4))
+				ERR_USAGE("usage: %s [--stats | --dump-recent "
+				          "[COUNT [MSEC]]]", prog_name);
+
+			if (STREQ(argv[1], "--stats")) {
+				if (trace_stats(TRACE_FILE) == -1)
+					ERR_NOINPUT("%s: %s.", TRACE_FILE,
+					            strerror(errno));
+				exit(0);
+			}
+
+			long args[] = {CR_TRACE_SLOTS, 0};
+			int i;
+			for (i = 2; i < argc; i++) {
+				char *end = NULL;
+				errno = 0;
+				long num = strtol(argv[i], &end, 10);
+				if (errno || *end != '\0' || end == argv[i] ||
+				    num < 0 || num > INT32_MAX)
+					ERR_USAGE("%s: not a number.", argv[i]);
+				args[i - 2] = num;
+			}
+
+			if (trace_dump(TRACE_FILE, (size_t) args[0],
+			               (uint64_t) args[1] * 1000) == -1)
+				ERR_NOINPUT("%s: %s.", TRACE_FILE,
+				            strerror(errno));
+			exit(0);
+		}
+	#endif
+
+
 	/*
 	 * Create safe environment
 	 * -----------------------
@@ -1421,9 +2442,9 @@ int main (int argc, const char *argv[]) {
 		int len = strnlen(*env_p, CR_ENVVAR_MAX);
 		if (len >= CR_ENVVAR_MAX)
 			// FIXME: print a warning.
-			continue;
+			goto next;
 		if (len == 0)
-			continue;
+			goto next;
 		const char *const *safe = safe_env_vars;
 		while (*safe) {
 			if (STRSTARTW(*env_p, *safe)) {
@@ -1456,6 +2477,8 @@ int main (int argc, const char *argv[]) {
 
 	setenv_f("PATH", SECURE_PATH, 1);
 
+	trace_stage(CR_STAGE_ENV);
+
 
 	/*
 	 * Change working directory
@@ -1466,6 +2489,51 @@ int main (int argc, const char *argv[]) {
 	ASSERT(chdir("/") == 0, "chdir /: %s", strerror(errno));
 
 
+	/*
+	 * Open trace file
+	 * ---------------
+	 */
+
+	// Done first, so that configuration errors are recorded, too.
+
+	#ifdef TRACE_FILE
+		ASS_CONF_NEMPTY(TRACE_FILE);
+
+		// TRACE_FILE need not exist yet, so the path
+		// of its parent directory is checked instead.
+		size_t trace_len = strlen(TRACE_FILE) + 1;
+		// flawfinder: ignore
+		char trace_dir_buf[trace_len];
+		// flawfinder: ignore
+		char trace_base_buf[trace_len];
+		// flawfinder: ignore
+		memcpy(trace_dir_buf, TRACE_FILE, trace_len);
+		// flawfinder: ignore
+		memcpy(trace_base_buf, TRACE_FILE, trace_len);
+		char *trace_dir = dirname(trace_dir_buf);
+		char *trace_base = basename(trace_base_buf);
+
+		char *restrict trace_canon = NULL;
+		ASS_CANON(trace_canon, trace_dir);
+		ASSERT(STRNE(trace_base, ".") && STRNE(trace_base, ".."),
+		       "%s: not canonical.", TRACE_FILE);
+
+		size_t trace_canon_len = strlen(trace_canon) + 1;
+		// flawfinder: ignore
+		char trace_path[trace_canon_len + trace_len];
+		// flawfinder: ignore
+		snprintf(trace_path, sizeof(trace_path), "%s%s%s", trace_canon,
+		         STREQ(trace_canon, "/") ? "" : "/", trace_base);
+		ASSERT(STREQ(trace_path, TRACE_FILE),
+		       "%s: not canonical.", TRACE_FILE);
+		free(trace_canon); trace_canon = NULL;
+
+		ASS_EXCL_OWNER(0, 0, TRACE_FILE, NULL);
+		trace = trace_open_f(TRACE_FILE);
+		trace_sampled = trace_sample(trace);
+	#endif
+
+
 	/*
 	 * Check configuration
 	 * -------------------
@@ -1478,7 +2546,7 @@ int main (int argc, const char *argv[]) {
 	ASS_CANON(cgi_handler, CGI_HANDLER);
 	free(cgi_handler); cgi_handler = NULL;
 	
-	is_excl_owner_f(0, 0, CGI_HANDLER, NULL);
+	ASS_EXCL_OWNER(0, 0, CGI_HANDLER, NULL);
 
 	struct stat cgi_handler_fs;
 	ASS_STAT(CGI_HANDLER, &cgi_handler_fs);
@@ -1500,7 +2568,7 @@ int main (int argc, const char *argv[]) {
 	ASS_CANON(script_base_dir, SCRIPT_BASE_DIR);
 	free(script_base_dir); script_base_dir = NULL;
 
-	is_excl_owner_f(0, 0, SCRIPT_BASE_DIR, NULL);
+	ASS_EXCL_OWNER(0, 0, SCRIPT_BASE_DIR, NULL);
 
 	struct stat script_base_dir_fs;
 
@@ -1534,6 +2602,8 @@ int main (int argc, const char *argv[]) {
 	pwd = NULL;
 	grp = NULL;
 
+	trace_stage(CR_STAGE_CONF);
+
 
 	/*
 	 * Self-check
@@ -1544,7 +2614,7 @@ int main (int argc, const char *argv[]) {
 	// to begin with, of course. Their purpose is to force the user
 	// to secure their setup.
 
-	is_excl_owner_f(0, 0, prog_path, NULL);
+	ASS_EXCL_OWNER(0, 0, prog_path, NULL);
 
 	struct stat prog_fs;
 	ASS_STAT(prog_path, &prog_fs);
@@ -1554,6 +2624,8 @@ int main (int argc, const char *argv[]) {
 	ASS_NWOTH(prog_path, prog_fs);
 	ASS_NXOTH(prog_path, prog_fs);
 
+	trace_stage(CR_STAGE_SELF);
+
 
 	/*
 	 * Get script's path
@@ -1574,6 +2646,8 @@ int main (int argc, const char *argv[]) {
 
 	struct stat script_fs;
 	ASS_STAT(script_path, &script_fs);
+	trace_rec.uid = script_fs.st_uid;
+	trace_rec.ino = script_fs.st_ino;
 	ASS_ISREG(script_path, script_fs);
 	ASSERT(script_fs.st_uid != 0,
 	                "%s: UID is 0.", script_path);
@@ -1600,6 +2674,8 @@ int main (int argc, const char *argv[]) {
 	// we might need them for `initgroups`
 	// when dropping privileges. 
 
+	trace_stage(CR_STAGE_SCRIPT);
+
 
 	/*
 	 * Drop privileges
@@ -1620,10 +2696,19 @@ int main (int argc, const char *argv[]) {
 			ERR_OSERR("setgroups 0: %s.", strerror(errno));
 	#endif
 
+	// Requires CAP_SYS_RESOURCE, so it must be done before setuid.
+	// The setting is inherited by the CGI handler (Linux >= 6.7).
+	// This is only a hint. Kernels without KSM fail with EINVAL;
+	// errors are ignored, so that no request is refused because of it.
+	#ifdef MEMORY_MERGE
+		(void) prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0);
+		errno = 0;
+	#endif
+
 	if (setgid(script_fs.st_gid) != 0)
 		ERR_OSERR("setgid %d: %s.", script_fs.st_gid, strerror(errno));
 	if (setuid(script_fs.st_uid) != 0)
-		ERR_OSERR("setuid %s: %s.", script_fs.st_uid, strerror(errno));
+		ERR_OSERR("setuid %d: %s.", script_fs.st_uid, strerror(errno));
 	if (setuid(0) != -1)
 		ERR_OSERR("setuid 0: %s.", strerror(errno));
 
@@ -1631,6 +2716,8 @@ int main (int argc, const char *argv[]) {
 	pwd = NULL;
 	grp = NULL;
 
+	trace_stage(CR_STAGE_DROP);
+
 
 	/*
 	 * Check if run by webserver
@@ -1651,25 +2738,25 @@ int main (int argc, const char *argv[]) {
 	 * ------------------------------------------
 	 */
 
-	is_subdir_f(script_path, SCRIPT_BASE_DIR);
+	ASS_SUBDIR(script_path, SCRIPT_BASE_DIR);
 
 	char *restrict home_dir = NULL;
 	ASS_CANON(home_dir, pwd->pw_dir);
 	free(home_dir); home_dir = NULL;
 
-	is_subdir_f(script_path, pwd->pw_dir);
+	ASS_SUBDIR(script_path, pwd->pw_dir);
 
 	char *document_root_e = NULL;
 	document_root_e = getenv_f("DOCUMENT_ROOT");
 
 	char *restrict document_root = NULL;
 	ASS_CANON(document_root, document_root_e);
-	is_subdir_f(script_path, document_root);
+	ASS_SUBDIR(script_path, document_root);
 	free(document_root); document_root = NULL;
 
-	is_excl_owner_f(script_fs.st_uid, script_fs.st_gid,
-	                script_path, pwd->pw_dir);
-	is_excl_owner_f(0, 0, pwd->pw_dir, NULL);
+	ASS_EXCL_OWNER(script_fs.st_uid, script_fs.st_gid,
+	               script_path, pwd->pw_dir);
+	ASS_EXCL_OWNER(0, 0, pwd->pw_dir, NULL);
 
 	ASS_NWOTH(script_path, script_fs);
 	ASS_NSUID(script_path, script_fs);
@@ -1688,12 +2775,31 @@ int main (int argc, const char *argv[]) {
 	       script_path, SCRIPT_SUFFIX);
 
 
+	/*
+	 * Set priority
+	 * ------------
+	 */
+
+	// This is only a hint. The priority is only ever lowered, and
+	// errors are ignored, so that no request is refused because of it.
+
+	const prio_class_t *class = prio_class();
+	if (class) {
+		errno = 0;
+		int nice = getpriority(PRIO_PROCESS, 0);
+		if (errno == 0 && class->nice > nice)
+			(void) setpriority(PRIO_PROCESS, 0, class->nice);
+		errno = 0;
+	}
+
+
 	/*
 	 * Call CGI handler
 	 * ----------------
 	 */
 
 	char *const args[] = { CGI_HANDLER, NULL };
+	trace_commit(0, 0);
 	execve(CGI_HANDLER, args, environ);
 
 	ERR_OSERR("execve %s: %s.", CGI_HANDLER, strerror(errno));
@@ -49,3 +49,13 @@
 // Only processes running as this group may call cgi-runas.
 // Should be set to the group your webserver runs as.
 #define WWW_GROUP "www-data"
+
+// A file.
+// A record of each request is kept in this file.
+// Uncomment to enable tracing.
+// #define TRACE_FILE "/run/cgi-runas.trace"
+
+// A number.
+// Only one in this many requests is recorded in detail;
+// the others are only counted. See MANUAL.rst for details.
+#define TRACE_SAMPLE_RATE 1